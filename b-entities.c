@@ -0,0 +1,107 @@
+/*	Copyright 2012 Christoph Gärtner, ooxi/entities
+		https://bitbucket.org/cggaertner/cstuff
+		https://github.com/ooxi/entities
+
+	Distributed under the Boost Software License, Version 1.0
+*/
+
+#include "entities.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*	Adversarial inputs: none of them contains a complete entity, so any
+	lookahead for `;' that is not bounded shows up as a per byte cost
+	growing with the input size.
+*/
+static const char *const PATTERNS[] = {
+	"&",
+	"&amp ",
+	"&thetasym",
+	"&#x1",
+	"&#",
+	"a&",
+	"%",
+	"&%",
+	"%26"
+};
+
+static void fill(char *buffer, size_t size, const char *pattern)
+{
+	size_t pattern_len = strlen(pattern);
+
+	for(size_t i = 0; i < size; ++i)
+		buffer[i] = pattern[i % pattern_len];
+
+	buffer[size] = 0;
+}
+
+static double ns_per_byte(clock_t start, size_t size, int rounds)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / (double)size
+		/ rounds;
+}
+
+int main(void)
+{
+	static const size_t SIZES[] = { 1ul << 16, 1ul << 18, 1ul << 20 };
+	size_t max_size = SIZES[sizeof SIZES / sizeof *SIZES - 1];
+
+	char *src = malloc(max_size + 1);
+	char *dest = malloc(max_size + 1);
+	if(!src || !dest)
+		return EXIT_FAILURE;
+
+	fprintf(stdout, "%-12s %10s %10s %10s %10s %10s %10s\n", "pattern",
+		"size", "utf8", "wo_unsafe", "wo_unsafe_n", "pct_first",
+		"ent_first");
+
+	for(size_t p = 0; p < sizeof PATTERNS / sizeof *PATTERNS; ++p)
+	{
+		for(size_t s = 0; s < sizeof SIZES / sizeof *SIZES; ++s)
+		{
+			size_t size = SIZES[s];
+			int rounds = (int)(SIZES[sizeof SIZES / sizeof *SIZES - 1] / size);
+			double results[5];
+
+			fill(src, size, PATTERNS[p]);
+
+			clock_t start = clock();
+			for(int r = 0; r < rounds; ++r)
+				decode_html_entities_utf8(dest, src);
+			results[0] = ns_per_byte(start, size, rounds);
+
+			start = clock();
+			for(int r = 0; r < rounds; ++r)
+				decode_html_entities_utf8_wo_unsafe_symbols(dest, src, "<\0>\0\0");
+			results[1] = ns_per_byte(start, size, rounds);
+
+			start = clock();
+			for(int r = 0; r < rounds; ++r)
+				decode_html_entities_utf8_wo_unsafe_symbols_n(dest, src, size, "<\0>\0\0");
+			results[2] = ns_per_byte(start, size, rounds);
+
+			start = clock();
+			for(int r = 0; r < rounds; ++r)
+				decode_percent_and_html_entities_utf8_n(dest, src, size,
+					"<\0>\0\0", PERCENT_DECODE_FIRST);
+			results[3] = ns_per_byte(start, size, rounds);
+
+			start = clock();
+			for(int r = 0; r < rounds; ++r)
+				decode_percent_and_html_entities_utf8_n(dest, src, size,
+					"<\0>\0\0", ENTITY_DECODE_FIRST);
+			results[4] = ns_per_byte(start, size, rounds);
+
+			fprintf(stdout, "%-12s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+				PATTERNS[p], (unsigned long)size, results[0], results[1],
+				results[2], results[3], results[4]);
+		}
+	}
+
+	free(src);
+	free(dest);
+
+	return EXIT_SUCCESS;
+}
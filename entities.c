@@ -5,16 +5,35 @@
 	Distributed under the Boost Software License, Version 1.0
 */
 
+#define _POSIX_C_SOURCE 200112L /* pthread_mutex_t */
+
 #include "entities.h"
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h> /* LONG_MAX */
+#include <stdint.h> /* uint64_t */
 #include <ctype.h> /* isspace() */
+#include <pthread.h>
+#include <sys/uio.h> /* struct iovec */
 
 #define UNICODE_MAX 0x10FFFFul
 
+/*	Longest entity name, bounds the search for its terminating `;' so that
+	decoding stays linear in the input size
+*/
+#define ENTITY_NAME_MAX (sizeof "thetasym;" - 1)
+
+/*	Longest entity (including `&' and `;') the fused percent decoder reads
+	through percent escapes
+*/
+#define ENTITY_LOOKAHEAD 32
+
+/*	Longest decoded entity
+*/
+#define UTF8_MAX 4
+
 static const char *const NAMED_ENTITIES[][2] = {
 	{ "AElig;", "Æ" },
 	{ "Aacute;", "Á" },
@@ -326,32 +345,50 @@ static size_t putc_utf8(unsigned long cp, char *buffer)
 	return 0;
 }
 
+static const char* strchr_n(const char* src, size_t src_size, int chr)
+{
+	size_t i;
+	for (i = 0; i < src_size && src[i] != '\0'; ++i)
+	{
+		if ((int)src[i] == chr)
+		{
+			return &src[i];
+		}
+	}
+
+	return NULL;
+}
+
 static _Bool parse_entity(
 	const char *current, char **to, const char **from)
 {
-	const char *end = strchr(current, ';');
-	if(!end) return 0;
-
 	if(current[1] == '#')
 	{
 		char *tail = NULL;
 		int errno_save = errno;
 		_Bool hex = current[2] == 'x' || current[2] == 'X';
+		const char *digits = current + (hex ? 3 : 2);
 
 		errno = 0;
-		unsigned long cp = strtoul(
-			current + (hex ? 3 : 2), &tail, hex ? 16 : 10);
+		unsigned long cp = strtoul(digits, &tail, hex ? 16 : 10);
 
-		_Bool fail = errno || tail != end || cp > UNICODE_MAX;
+		// the digits have to be followed by `;' right away
+		_Bool fail = errno || tail == digits || *tail != ';'
+			|| cp > UNICODE_MAX;
 		errno = errno_save;
 		if(fail) return 0;
 
+		const char *end = tail;
+
 		*to += putc_utf8(cp, *to);
 		*from = end + 1;
 
 		return 1;
 	}
 
+	const char *end = strchr_n(current, ENTITY_NAME_MAX + 1, ';');
+	if(!end) return 0;
+
 	const char *entity = get_named_entity(&current[1]);
 	if(!entity) return 0;
 
@@ -394,50 +431,66 @@ size_t decode_html_entities_utf8(char *dest, const char *src)
 }
 
 
+static _Bool is_unsafe_symb(const char *symb, size_t symb_len,
+	const char* unsafe_symbs)
+{
+	size_t unsafe_symbs_len;
+	for (const char* unsafe_symb = unsafe_symbs; (unsafe_symbs_len = strlen(unsafe_symb)) != 0; unsafe_symb += (unsafe_symbs_len + 1))
+	{
+		if (symb_len == unsafe_symbs_len && strncmp(symb, unsafe_symb, symb_len) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
 static _Bool parse_entity_wo_unsafe_symbols(
 	const char *current, char **to, const char **from,
 	const char* unsafe_symbs)
 {
-	const char *end = strchr(current, ';');
-	if(!end) return 0;
-
 	if(current[1] == '#')
 	{
 		char *tail = NULL;
 		int errno_save = errno;
 		_Bool hex = current[2] == 'x' || current[2] == 'X';
+		const char *digits = current + (hex ? 3 : 2);
 
 		errno = 0;
-		unsigned long cp = strtoul(
-			current + (hex ? 3 : 2), &tail, hex ? 16 : 10);
+		unsigned long cp = strtoul(digits, &tail, hex ? 16 : 10);
 
-		_Bool fail = errno || tail != end || cp > UNICODE_MAX;
+		// the digits have to be followed by `;' right away
+		_Bool fail = errno || tail == digits || *tail != ';'
+			|| cp > UNICODE_MAX;
 		errno = errno_save;
 		if(fail) return 0;
 
+		const char *end = tail;
 
-		// *to += putc_utf8(cp, *to);
-		size_t utf8_symb_len = putc_utf8(cp, *to);
 
-		size_t unsafe_symbs_len;
-		for (const char* unsafe_symb = unsafe_symbs; (unsafe_symbs_len = strlen(unsafe_symb)) != 0; unsafe_symb += (unsafe_symbs_len + 1))
+		// encoded aside, *to may overlap current when decoding in-place
+		char utf8_symb[UTF8_MAX];
+		size_t utf8_symb_len = putc_utf8(cp, utf8_symb);
+
+		if (is_unsafe_symb(utf8_symb, utf8_symb_len, unsafe_symbs))
 		{
-			if (utf8_symb_len == unsafe_symbs_len && strncmp(*to, unsafe_symb, utf8_symb_len) == 0)
-			{
-				// rollback
-				size_t html_entities_len = (size_t)(end - current) + 1;
-				memmove(*to, current, html_entities_len);
-				utf8_symb_len = html_entities_len;
-				break;
-			}
+			// rollback
+			size_t html_entities_len = (size_t)(end - current) + 1;
+			memmove(*to, current, html_entities_len);
+			*to += html_entities_len;
+		}
+		else
+		{
+			memcpy(*to, utf8_symb, utf8_symb_len);
+			*to += utf8_symb_len;
 		}
-
-		*to += utf8_symb_len;
 		*from = end + 1;
 
 		return 1;
 	}
 
+	const char *end = strchr_n(current, ENTITY_NAME_MAX + 1, ';');
+	if(!end) return 0;
+
 	const char *entity = get_named_entity(&current[1]);
 	if(!entity) return 0;
 
@@ -485,53 +538,38 @@ static int strcmp_n(const char *lhs, size_t lhs_len, const char *rhs)
 {
 	size_t rhs_len = strlen(rhs);
 
-	if (rhs_len > lhs_len)
-		return rhs[lhs_len];
-	else if (rhs_len < lhs_len)
-		return lhs[rhs_len];
-
-	// equal len
-	int i = 0;
-	while (lhs[i] == rhs[i] && lhs_len > 0){
-		++i;
-		--lhs_len;
-	}
+	int res = memcmp(lhs, rhs, lhs_len < rhs_len ? lhs_len : rhs_len);
+	if (res != 0)
+		return res;
 
-	return lhs_len == 0 ? 0 : lhs[i] - rhs[i];
+	// common prefix, shorter one goes first
+	return (lhs_len > rhs_len) - (lhs_len < rhs_len);
 }
 
-static size_t clang_is_good = 0;
+struct name_n {
+	const char *name;
+	size_t name_len;
+};
 
 static int cmp_n(const void *key, const void *value)
 {
-	return strcmp_n((const char *)key, clang_is_good, 
-		(const char *)value);
+	const struct name_n *name = (const struct name_n *)key;
+
+	return strcmp_n(name->name, name->name_len,
+		*(const char *const *)value);
 }
 
 static const char *get_named_entity_n(const char *name, size_t name_len)
 {
-	clang_is_good = name_len;
-	const char *const *entity = (const char *const *)bsearch(name,
+	// passed as key rather than through a global to stay reentrant
+	struct name_n key = { name, name_len };
+	const char *const *entity = (const char *const *)bsearch(&key,
 		NAMED_ENTITIES, sizeof NAMED_ENTITIES / sizeof *NAMED_ENTITIES,
 		sizeof *NAMED_ENTITIES, cmp_n);
 
 	return entity ? entity[1] : NULL;
 }
 
-static const char* strchr_n(const char* src, size_t src_size, int chr)
-{
-	size_t i;
-	for (i = 0; i < src_size && src[i] != '\0'; ++i)
-	{
-		if ((int)src[i] == chr)
-		{
-			break;
-		}
-	}
-
-	return i < src_size ? &src[i] : NULL;
-}
-
 /*https://stackoverflow.com/questions/7457163/what-is-the-implementation-of-strtol*/
 static unsigned long 
 strtoul_n(const char *restrict nptr, size_t nptr_len, char **restrict endptr, int base) {
@@ -547,7 +585,7 @@ strtoul_n(const char *restrict nptr, size_t nptr_len, char **restrict endptr, in
         return 0L;
     }
     endp = nptr;
-    while (nptr_len > 0 && isspace(*p)){
+    while (nptr_len > 0 && isspace((unsigned char)*p)){
         p++;
     	--nptr_len;
     }
@@ -567,6 +605,7 @@ strtoul_n(const char *restrict nptr, size_t nptr_len, char **restrict endptr, in
             break;
         if (c < 0 || c >= base) break;
         endp = ++p;
+        --nptr_len;
         if (overflow) {
             /* endptr should go forward and point to the non-digit character
              * (of the given base); required by ANSI standard. */
@@ -577,7 +616,6 @@ strtoul_n(const char *restrict nptr, size_t nptr_len, char **restrict endptr, in
             overflow = 1; continue;
         }
         n = n * base + c;
-        --nptr_len;
     }
 
     if (endptr) *endptr = (char *)endp;
@@ -594,43 +632,45 @@ static _Bool parse_entity_wo_unsafe_symbols_n(
 	char **to, const char **from,
 	const char* unsafe_symbs)
 {
-	const char *end = strchr_n(current, *curr_size, ';');
-	if(!end) return 0;
-
 	// *curr_size should be more than 3 (start symb, # and ;)
-	size_t entity_len = (end - current);
-	if(entity_len > 3 && current[1] == '#')
+	if(*curr_size > 3 && current[1] == '#')
 	{
 		char *tail = NULL;
 		int errno_save = errno;
-		_Bool hex = entity_len > 4 && (current[2] == 'x' || current[2] == 'X');
+		_Bool hex = current[2] == 'x' || current[2] == 'X';
+		const char *digits = current + (hex ? 3 : 2);
+		const char *stop = current + *curr_size;
 
 		errno = 0;
 		unsigned long cp = strtoul_n(
-			current + (hex ? 3 : 2), *curr_size - (hex ? 3 : 2), &tail, hex ? 16 : 10);
+			digits, (size_t)(stop - digits), &tail, hex ? 16 : 10);
 
-		_Bool fail = errno || tail != end || cp > UNICODE_MAX;
+		// the digits have to be followed by `;' right away
+		_Bool fail = errno || tail == digits || tail == stop || *tail != ';'
+			|| cp > UNICODE_MAX;
 		errno = errno_save;
 
 
 		if(fail) return 0;
 
-		size_t utf8_symb_len = putc_utf8(cp, *to);
+		const char *end = tail;
+
+		// encoded aside, *to may overlap current when decoding in-place
+		char utf8_symb[UTF8_MAX];
+		size_t utf8_symb_len = putc_utf8(cp, utf8_symb);
 
-		size_t unsafe_symbs_len;
-		for (const char* unsafe_symb = unsafe_symbs; (unsafe_symbs_len = strlen(unsafe_symb)) != 0; unsafe_symb += (unsafe_symbs_len + 1))
+		if (is_unsafe_symb(utf8_symb, utf8_symb_len, unsafe_symbs))
 		{
-			if (utf8_symb_len == unsafe_symbs_len && strncmp(*to, unsafe_symb, utf8_symb_len) == 0)
-			{
-				// rollback
-				size_t html_entities_len = (size_t)(end - current) + 1;
-				memmove(*to, current, html_entities_len);
-				utf8_symb_len = html_entities_len;
-				break;
-			}
+			// rollback
+			size_t html_entities_len = (size_t)(end - current) + 1;
+			memmove(*to, current, html_entities_len);
+			*to += html_entities_len;
+		}
+		else
+		{
+			memcpy(*to, utf8_symb, utf8_symb_len);
+			*to += utf8_symb_len;
 		}
-
-		*to += utf8_symb_len;
 		*from = end + 1;
 
 		*curr_size -= end - current + 1;
@@ -640,7 +680,13 @@ static _Bool parse_entity_wo_unsafe_symbols_n(
 	if (*curr_size < 2)	
 		return 0;
 
-	const char *entity = get_named_entity_n(&current[1], *curr_size - 1);
+	// bounded by the longest entity name
+	const char *end = strchr_n(current,
+		*curr_size < ENTITY_NAME_MAX + 1 ? *curr_size : ENTITY_NAME_MAX + 1, ';');
+	if(!end) return 0;
+
+	// name including the terminating `;'
+	const char *entity = get_named_entity_n(&current[1], (size_t)(end - current));
 	if(!entity) return 0;
 
 	size_t len = strlen(entity);
@@ -680,4 +726,1317 @@ size_t decode_html_entities_utf8_wo_unsafe_symbols_n(char *dest, const char *src
 	to += src_size;
 
 	return (size_t)(to - dest);
-}
\ No newline at end of file
+}
+
+static const char *const RAW_TEXT_ELEMENTS[] = {
+	"iframe", "noembed", "noframes", "script", "style", "xmp", NULL
+};
+
+static const char *const ESCAPABLE_RAW_TEXT_ELEMENTS[] = {
+	"textarea", "title", NULL
+};
+
+static _Bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\f' || c == '\r';
+}
+
+static _Bool is_alpha(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static _Bool strieq_n(const char *lhs, const char *rhs, size_t len)
+{
+	for(size_t i = 0; i < len; ++i)
+	{
+		if(tolower((unsigned char)lhs[i]) != tolower((unsigned char)rhs[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+static _Bool is_element_n(const char *name, size_t name_len,
+	const char *const *elements)
+{
+	for(; *elements; ++elements)
+	{
+		if(strlen(*elements) == name_len && strieq_n(name, *elements, name_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+static const char *find_n(const char *src, const char *stop, const char *seq)
+{
+	size_t seq_len = strlen(seq);
+
+	for(const char *current = src;
+		(size_t)(stop - current) >= seq_len
+			&& (current = memchr(current, *seq, (size_t)(stop - current)));
+		++current)
+	{
+		if((size_t)(stop - current) >= seq_len
+			&& memcmp(current, seq, seq_len) == 0)
+			return current;
+	}
+
+	return NULL;
+}
+
+/*	Finds the end tag </name> which terminates (escapable) raw text.
+*/
+static const char *find_end_tag_n(const char *src, const char *stop,
+	const char *name, size_t name_len)
+{
+	for(const char *current = src;
+		current < stop
+			&& (current = memchr(current, '<', (size_t)(stop - current)));
+		++current)
+	{
+		if((size_t)(stop - current) < name_len + 2 || current[1] != '/'
+			|| !strieq_n(current + 2, name, name_len))
+			continue;
+
+		const char *after = current + 2 + name_len;
+		if(after == stop || is_space(*after) || *after == '/' || *after == '>')
+			return current;
+	}
+
+	return stop;
+}
+
+static void copy_n(char **to, const char *from, const char *stop)
+{
+	memmove(*to, from, (size_t)(stop - from));
+	*to += stop - from;
+}
+
+static void decode_n(char **to, const char *from, const char *stop,
+	const char* unsafe_symbs)
+{
+	*to += decode_html_entities_utf8_wo_unsafe_symbols_n(*to, from,
+		(size_t)(stop - from), unsafe_symbs);
+}
+
+/*	Copies the tag starting at <from> to <*to>, decoding attribute values,
+	and returns the position right after the tag. <*name> and <*name_len>
+	are set to the tag name.
+*/
+static const char *copy_tag_n(char **to, const char *from, const char *stop,
+	const char* unsafe_symbs, const char **name, size_t *name_len)
+{
+	const char *run = from;
+	const char *current = from + (from[1] == '/' ? 2 : 1);
+
+	*name = current;
+	while(current < stop && !is_space(*current)
+		&& *current != '/' && *current != '>')
+		++current;
+	*name_len = (size_t)(current - *name);
+
+	while(current < stop && *current != '>')
+	{
+		if(*current++ != '=')
+			continue;
+
+		while(current < stop && is_space(*current))
+			++current;
+		if(current == stop)
+			break;
+
+		const char *value = current;
+		const char *value_end;
+
+		if(*current == '"' || *current == '\'')
+		{
+			++value;
+			value_end = memchr(value, *current, (size_t)(stop - value));
+			if(!value_end) value_end = stop;
+		}
+		else
+		{
+			value_end = value;
+			while(value_end < stop && !is_space(*value_end)
+				&& *value_end != '>')
+				++value_end;
+		}
+
+		copy_n(to, run, value);
+		decode_n(to, value, value_end, unsafe_symbs);
+		run = current = value_end;
+		if(current < stop && *current != '>' && !is_space(*current))
+			++current;
+	}
+
+	if(current < stop)
+		++current;
+
+	copy_n(to, run, current);
+	return current;
+}
+
+size_t decode_html_entities_utf8_markup_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs)
+{
+	if(!src) src = dest;
+
+	char *to = dest;
+	const char *from = src;
+	const char *const stop = src + src_size;
+
+	while(from < stop)
+	{
+		const char *current = memchr(from, '<', (size_t)(stop - from));
+		if(!current) current = stop;
+
+		decode_n(&to, from, current, unsafe_symbs);
+		from = current;
+
+		if(from == stop)
+			break;
+
+		size_t remaining = (size_t)(stop - from);
+		const char *end = NULL;
+
+		if(remaining >= 4 && memcmp(from, "<!--", 4) == 0)
+		{
+			// `<!-->' and `<!--->' are complete (empty) comments
+			end = find_n(from + 2, stop, "-->");
+			end = end ? end + 3 : stop;
+		}
+		else if(remaining >= 9 && memcmp(from, "<![CDATA[", 9) == 0)
+		{
+			end = find_n(from + 9, stop, "]]>");
+			end = end ? end + 3 : stop;
+		}
+		else if(remaining >= 2 && (is_alpha(from[1])
+			|| (remaining >= 3 && from[1] == '/' && is_alpha(from[2]))))
+		{
+			_Bool end_tag = from[1] == '/';
+			const char *name;
+			size_t name_len;
+
+			from = copy_tag_n(&to, from, stop, unsafe_symbs, &name, &name_len);
+
+			if(end_tag)
+				continue;
+
+			if(is_element_n(name, name_len, RAW_TEXT_ELEMENTS))
+			{
+				end = find_end_tag_n(from, stop, name, name_len);
+				copy_n(&to, from, end);
+				from = end;
+			}
+			else if(is_element_n(name, name_len, ESCAPABLE_RAW_TEXT_ELEMENTS))
+			{
+				end = find_end_tag_n(from, stop, name, name_len);
+				decode_n(&to, from, end, unsafe_symbs);
+				from = end;
+			}
+
+			continue;
+		}
+		else if(remaining >= 2 && (from[1] == '!' || from[1] == '?'
+			|| from[1] == '/'))
+		{
+			// doctype, processing instruction or bogus comment
+			end = memchr(from, '>', remaining);
+			end = end ? end + 1 : stop;
+		}
+		else
+		{
+			// a lone `<' is just text
+			end = from + 1;
+		}
+
+		copy_n(&to, from, end);
+		from = end;
+	}
+
+	return (size_t)(to - dest);
+}
+
+
+#define BYTES_OF(c) (UINT64_C(0x0101010101010101) * (unsigned char)(c))
+
+/*	Non-zero if any byte of <word> is zero
+*/
+static uint64_t zero_bytes(uint64_t word)
+{
+	return (word - BYTES_OF(0x01)) & ~word & BYTES_OF(0x80);
+}
+
+/*	Word-at-a-time search for the first of two characters, returns <NULL>
+	if neither occurs in [<src>, <stop>).
+*/
+static const char *find_either_n(const char *src, const char *stop,
+	char a, char b)
+{
+	const uint64_t pattern_a = BYTES_OF(a);
+	const uint64_t pattern_b = BYTES_OF(b);
+
+	while((size_t)(stop - src) >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, src, sizeof word);
+
+		if(zero_bytes(word ^ pattern_a) | zero_bytes(word ^ pattern_b))
+			break;
+
+		src += sizeof word;
+	}
+
+	for(; src < stop; ++src)
+	{
+		if(*src == a || *src == b)
+			return src;
+	}
+
+	return NULL;
+}
+
+static int hex_digit(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static int percent_byte_n(const char *current, const char *stop)
+{
+	if(stop - current < 3 || *current != '%')
+		return -1;
+
+	int high = hex_digit(current[1]);
+	int low = hex_digit(current[2]);
+
+	return high < 0 || low < 0 ? -1 : high << 4 | low;
+}
+
+/*	Decodes the percent-encoded byte at <current> into <to>, together with
+	its `%XX' continuation bytes if it starts a UTF-8 sequence. Unsafe
+	symbols are copied verbatim. Returns the number of characters consumed
+	or 0 if <current> is not a valid escape.
+*/
+static size_t parse_percent_n(const char *current, const char *stop,
+	char *to, size_t *to_len, const char* unsafe_symbs)
+{
+	int lead = percent_byte_n(current, stop);
+	if(lead < 0) return 0;
+
+	size_t seq_len = lead < 0xC0 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3
+		: lead < 0xF8 ? 4 : 1;
+
+	to[0] = (char)lead;
+	for(size_t i = 1; i < seq_len; ++i)
+	{
+		int cont = percent_byte_n(current + 3 * i, stop);
+		if(cont < 0x80 || cont > 0xBF)
+		{
+			seq_len = 1;
+			break;
+		}
+
+		to[i] = (char)cont;
+	}
+
+	*to_len = seq_len;
+	if(is_unsafe_symb(to, seq_len, unsafe_symbs))
+	{
+		// rollback
+		*to_len = 3 * seq_len;
+		memcpy(to, current, *to_len);
+	}
+
+	return 3 * seq_len;
+}
+
+/*	Decodes an entity at <current> into <to>, which must hold <UTF8_MAX>
+	characters, accepting the same entities as
+	<decode_html_entities_utf8_wo_unsafe_symbols_n>.
+
+	Returns 0 for unknown entities and for unsafe ones, which are left to
+	the caller as plain text.
+*/
+static size_t parse_entity_lookahead_n(const char *current, const char *stop,
+	char *to, size_t *to_len, const char* unsafe_symbs)
+{
+	size_t size = (size_t)(stop - current);
+	char *end = to;
+	const char *from = current;
+
+	// no unsafe symbols, a rollback could overflow <to>
+	if(*current != '&'
+		|| !parse_entity_wo_unsafe_symbols_n(current, &size, &end, &from, "\0"))
+		return 0;
+
+	// like parse_entity_wo_unsafe_symbols_n() only numeric ones are unsafe
+	if(current[1] == '#' && is_unsafe_symb(to, (size_t)(end - to), unsafe_symbs))
+		return 0;
+
+	*to_len = (size_t)(end - to);
+	return (size_t)(from - current);
+}
+
+/*	Reads one unit of the first decoding stage: either an escape decoded to
+	<to> or a single plain character. Returns the number of characters
+	consumed.
+*/
+static size_t read_unit_n(const char *current, const char *stop,
+	_Bool percent, char *to, size_t *to_len, const char* unsafe_symbs)
+{
+	size_t consumed = percent
+		? parse_percent_n(current, stop, to, to_len, unsafe_symbs)
+		: parse_entity_lookahead_n(current, stop, to, to_len, unsafe_symbs);
+
+	if(consumed)
+		return consumed;
+
+	*to = *current;
+	*to_len = 1;
+	return 1;
+}
+
+#define WINDOW_SIZE (2 * ENTITY_LOOKAHEAD)
+
+/*	Tells whether a unit of the first stage may continue an escape of the
+	second stage, i.e. consists of entity or `%XX' characters only.
+*/
+static _Bool continues_escape(const char *unit, size_t unit_len,
+	_Bool percent_first)
+{
+	for(size_t i = 0; i < unit_len; ++i)
+	{
+		char c = unit[i];
+		_Bool digit = c >= '0' && c <= '9';
+
+		if(percent_first ? !(digit || is_alpha(c) || c == '#' || c == ';')
+			: !(digit || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')
+				|| c == '%'))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*	Decodes an escape of the second stage starting at <current>, reading
+	its characters through the first stage. Returns the number of input
+	characters consumed or 0 if there is no such escape at <current>.
+
+	In percent first order the caller has already tried to decode an
+	entity right at <current>.
+*/
+static size_t parse_second_stage_n(const char *current, const char *stop,
+	_Bool percent_first, char **to, const char* unsafe_symbs)
+{
+	size_t need = percent_first ? ENTITY_LOOKAHEAD : 3 * UTF8_MAX;
+	size_t span = (size_t)(stop - current) < need
+		? (size_t)(stop - current) : need;
+
+	// without first stage escapes the window would just copy the input
+	if(!memchr(current, percent_first ? '%' : '&', span))
+	{
+		if(percent_first)
+			return 0;
+
+		char decoded[3 * UTF8_MAX];
+		size_t decoded_len;
+		size_t consumed = parse_percent_n(current, stop, decoded,
+			&decoded_len, unsafe_symbs);
+
+		memcpy(*to, decoded, consumed ? decoded_len : 0);
+		*to += consumed ? decoded_len : 0;
+
+		return consumed;
+	}
+
+	char window[WINDOW_SIZE];
+	// input offset for each window position ending a unit, 0 otherwise
+	size_t offsets[WINDOW_SIZE + 1];
+	size_t window_len = 0;
+
+	for(const char *next = current; next < stop && window_len < need;)
+	{
+		char unit[ENTITY_LOOKAHEAD];
+		size_t unit_len;
+		size_t consumed = read_unit_n(next, stop, percent_first, unit,
+			&unit_len, unsafe_symbs);
+
+		if(window_len + unit_len > WINDOW_SIZE)
+			break;
+
+		memcpy(window + window_len, unit, unit_len);
+		for(size_t i = 1; i < unit_len; ++i)
+			offsets[window_len + i] = 0;
+
+		window_len += unit_len;
+		next += consumed;
+		offsets[window_len] = (size_t)(next - current);
+
+		if(percent_first && unit_len == 1 && *unit == ';')
+			break;
+
+		// nothing past this unit can be part of the escape
+		if(window_len > unit_len
+			&& !continues_escape(unit, unit_len, percent_first))
+			break;
+	}
+
+	char decoded[WINDOW_SIZE];
+	size_t decoded_len = 0;
+	size_t window_consumed;
+
+	if(percent_first)
+	{
+		char *end = decoded;
+		const char *from = window;
+		size_t size = window_len;
+
+		window_consumed = parse_entity_wo_unsafe_symbols_n(window, &size,
+			&end, &from, unsafe_symbs) ? (size_t)(from - window) : 0;
+		decoded_len = (size_t)(end - decoded);
+	}
+	else
+	{
+		window_consumed = parse_percent_n(window, window + window_len,
+			decoded, &decoded_len, unsafe_symbs);
+	}
+
+	// the escape has to end on a unit boundary
+	if(!window_consumed || !offsets[window_consumed])
+		return 0;
+
+	memcpy(*to, decoded, decoded_len);
+	*to += decoded_len;
+
+	return offsets[window_consumed];
+}
+
+size_t decode_percent_and_html_entities_utf8_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs, enum percent_decode_order order)
+{
+	if(!src) src = dest;
+
+	char *to = dest;
+	const char *from = src;
+	const char *const stop = src + src_size;
+
+	const _Bool percent_first = order == PERCENT_DECODE_FIRST;
+	const char second = percent_first ? '&' : '%';
+
+	for(const char *current; (current = find_either_n(from, stop, '&', '%'));)
+	{
+		copy_n(&to, from, current);
+		from = current;
+
+		// entities contain no `%', decoding percent escapes first would
+		// not change them
+		if(percent_first && *from == '&')
+		{
+			char entity[UTF8_MAX];
+			size_t entity_len;
+			size_t consumed = parse_entity_lookahead_n(from, stop, entity,
+				&entity_len, unsafe_symbs);
+
+			if(consumed)
+			{
+				memcpy(to, entity, entity_len);
+				to += entity_len;
+				from += consumed;
+				continue;
+			}
+		}
+
+		char unit[ENTITY_LOOKAHEAD];
+		size_t unit_len;
+		size_t consumed = read_unit_n(from, stop, percent_first, unit,
+			&unit_len, unsafe_symbs);
+
+		if(*unit == second)
+		{
+			size_t escape_len = parse_second_stage_n(from, stop,
+				percent_first, &to, unsafe_symbs);
+
+			if(escape_len)
+			{
+				from += escape_len;
+				continue;
+			}
+		}
+
+		memcpy(to, unit, unit_len);
+		to += unit_len;
+		from += consumed;
+	}
+
+	copy_n(&to, from, stop);
+
+	return (size_t)(to - dest);
+}
+
+
+static int push_iovec(struct iovec *iov, int iov_count, int *used,
+	size_t *buffered, const char *base, size_t len,
+	decode_html_entities_sink sink, void *sink_data)
+{
+	if(!len)
+		return 0;
+
+	// extend the previous entry if contiguous, e.g. adjacent entities
+	if(*used && (const char *)iov[*used - 1].iov_base
+		+ iov[*used - 1].iov_len == base)
+	{
+		iov[*used - 1].iov_len += len;
+		return 0;
+	}
+
+	if(*used == iov_count)
+	{
+		if(!sink || sink(sink_data, iov, *used))
+			return -1;
+
+		*used = 0;
+		*buffered = 0;
+	}
+
+	iov[*used].iov_base = (void *)(uintptr_t)base;
+	iov[*used].iov_len = len;
+	++*used;
+
+	return 0;
+}
+
+int decode_html_entities_utf8_iovec_n(struct iovec *iov, int iov_count,
+	char *buffer, size_t buffer_size, const char *src, size_t src_size,
+	const char* unsafe_symbs, decode_html_entities_sink sink, void *sink_data)
+{
+	if(iov_count < 1)
+		return -1;
+
+	int used = 0;
+	size_t buffered = 0;
+
+	const char *run = src;
+	const char *from = src;
+	const char *const stop = src + src_size;
+
+	for(const char *current;
+		from < stop && (current = memchr(from, '&', (size_t)(stop - from)));)
+	{
+		char entity[UTF8_MAX];
+		size_t entity_len;
+		size_t consumed = parse_entity_lookahead_n(current, stop, entity,
+			&entity_len, unsafe_symbs);
+
+		from = current + 1;
+
+		// unknown and unsafe entities stay part of the unchanged run
+		if(!consumed)
+			continue;
+
+		if(push_iovec(iov, iov_count, &used, &buffered, run,
+			(size_t)(current - run), sink, sink_data))
+			return -1;
+
+		// flush first, entries must not be moved once <buffer> is written
+		if(buffered + entity_len > buffer_size || used == iov_count)
+		{
+			if(!sink || sink(sink_data, iov, used))
+				return -1;
+
+			used = 0;
+			buffered = 0;
+		}
+
+		memcpy(buffer + buffered, entity, entity_len);
+		if(push_iovec(iov, iov_count, &used, &buffered, buffer + buffered,
+			entity_len, sink, sink_data))
+			return -1;
+
+		buffered += entity_len;
+		run = from = current + consumed;
+	}
+
+	if(push_iovec(iov, iov_count, &used, &buffered, run,
+		(size_t)(stop - run), sink, sink_data))
+		return -1;
+
+	return used;
+}
+
+
+#define CACHE_SHARDS 16
+
+struct cache_entry {
+	struct cache_entry *next; // in bucket
+	struct cache_entry *newer, *older;
+	uint64_t hash;
+	size_t size; // accounted memory
+	size_t src_size, unsafe_symbs_size, decoded_size;
+	char data[]; // <src>, <unsafe_symbs>, decoded
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	struct cache_entry *newest, *oldest;
+	size_t used;
+	unsigned long long hits, misses;
+};
+
+struct decode_cache {
+	size_t shard_budget;
+	size_t bucket_mask;
+	struct cache_shard shards[CACHE_SHARDS];
+};
+
+struct decode_cache *decode_cache_create(size_t memory_budget)
+{
+	struct decode_cache *cache = calloc(1, sizeof *cache);
+	if(!cache) return NULL;
+
+	// about one bucket per 128 bytes of budget
+	size_t buckets = 16;
+	while(buckets < memory_budget / CACHE_SHARDS / 128)
+		buckets <<= 1;
+
+	cache->shard_budget = memory_budget / CACHE_SHARDS;
+	cache->bucket_mask = buckets - 1;
+
+	for(size_t i = 0; i < CACHE_SHARDS; ++i)
+	{
+		struct cache_shard *shard = &cache->shards[i];
+
+		shard->buckets = calloc(buckets, sizeof *shard->buckets);
+		if(!shard->buckets || pthread_mutex_init(&shard->lock, NULL))
+		{
+			free(shard->buckets);
+			shard->buckets = NULL;
+			decode_cache_destroy(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+void decode_cache_destroy(struct decode_cache *cache)
+{
+	if(!cache) return;
+
+	for(size_t i = 0; i < CACHE_SHARDS; ++i)
+	{
+		struct cache_shard *shard = &cache->shards[i];
+		if(!shard->buckets)
+			break;
+
+		for(struct cache_entry *entry = shard->newest, *older; entry;
+			entry = older)
+		{
+			older = entry->older;
+			free(entry);
+		}
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+
+	free(cache);
+}
+
+void decode_cache_stats(struct decode_cache *cache,
+	unsigned long long *hits, unsigned long long *misses)
+{
+	*hits = *misses = 0;
+
+	for(size_t i = 0; i < CACHE_SHARDS; ++i)
+	{
+		struct cache_shard *shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		*hits += shard->hits;
+		*misses += shard->misses;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/*	FNV-1a
+*/
+static uint64_t hash_n(uint64_t hash, const char *src, size_t src_size)
+{
+	for(size_t i = 0; i < src_size; ++i)
+	{
+		hash ^= (unsigned char)src[i];
+		hash *= UINT64_C(0x100000001B3);
+	}
+
+	return hash;
+}
+
+static size_t unsafe_symbs_size(const char* unsafe_symbs)
+{
+	const char *unsafe_symb = unsafe_symbs;
+
+	for(size_t len; (len = strlen(unsafe_symb)) != 0; unsafe_symb += len + 1)
+		;
+
+	return (size_t)(unsafe_symb - unsafe_symbs) + 1;
+}
+
+static void unlink_entry(struct cache_shard *shard, struct cache_entry *entry)
+{
+	if(entry->newer) entry->newer->older = entry->older;
+	else shard->newest = entry->older;
+
+	if(entry->older) entry->older->newer = entry->newer;
+	else shard->oldest = entry->newer;
+}
+
+static void link_newest(struct cache_shard *shard, struct cache_entry *entry)
+{
+	entry->newer = NULL;
+	entry->older = shard->newest;
+
+	if(shard->newest) shard->newest->newer = entry;
+	else shard->oldest = entry;
+
+	shard->newest = entry;
+}
+
+static struct cache_entry **find_entry(struct cache_entry **bucket,
+	uint64_t hash, const char *src, size_t src_size,
+	const char* unsafe_symbs, size_t symbs_size)
+{
+	for(; *bucket; bucket = &(*bucket)->next)
+	{
+		struct cache_entry *entry = *bucket;
+
+		if(entry->hash == hash && entry->src_size == src_size
+			&& entry->unsafe_symbs_size == symbs_size
+			&& memcmp(entry->data, src, src_size) == 0
+			&& memcmp(entry->data + src_size, unsafe_symbs, symbs_size) == 0)
+			return bucket;
+	}
+
+	return bucket;
+}
+
+static void evict_oldest(struct decode_cache *cache, struct cache_shard *shard)
+{
+	struct cache_entry *entry = shard->oldest;
+	struct cache_entry **bucket = &shard->buckets[
+		(entry->hash >> 4) & cache->bucket_mask];
+
+	while(*bucket != entry)
+		bucket = &(*bucket)->next;
+
+	*bucket = entry->next;
+	unlink_entry(shard, entry);
+	shard->used -= entry->size;
+	free(entry);
+}
+
+size_t decode_html_entities_utf8_cached_n(struct decode_cache *cache,
+	char *dest, const char *src, size_t src_size, const char* unsafe_symbs)
+{
+	if(!src) src = dest;
+
+	// nothing to decode, nothing worth caching
+	if(!memchr(src, '&', src_size))
+	{
+		memmove(dest, src, src_size);
+		return src_size;
+	}
+
+	size_t symbs_size = unsafe_symbs_size(unsafe_symbs);
+	uint64_t hash = hash_n(hash_n(UINT64_C(0xCBF29CE484222325),
+		src, src_size), unsafe_symbs, symbs_size);
+
+	struct cache_shard *shard = &cache->shards[hash % CACHE_SHARDS];
+	struct cache_entry **bucket = &shard->buckets[
+		(hash >> 4) & cache->bucket_mask];
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct cache_entry *entry = *find_entry(bucket, hash, src, src_size,
+		unsafe_symbs, symbs_size);
+
+	if(entry)
+	{
+		++shard->hits;
+		unlink_entry(shard, entry);
+		link_newest(shard, entry);
+
+		size_t decoded_size = entry->decoded_size;
+		memmove(dest, entry->data + src_size + symbs_size, decoded_size);
+
+		pthread_mutex_unlock(&shard->lock);
+		return decoded_size;
+	}
+
+	++shard->misses;
+	pthread_mutex_unlock(&shard->lock);
+
+	// decoded output is never longer than its input
+	size_t size = sizeof *entry + 2 * src_size + symbs_size;
+	entry = size <= cache->shard_budget ? malloc(size) : NULL;
+
+	if(entry)
+	{
+		memcpy(entry->data, src, src_size);
+		memcpy(entry->data + src_size, unsafe_symbs, symbs_size);
+	}
+
+	size_t decoded_size = decode_html_entities_utf8_wo_unsafe_symbols_n(
+		dest, src, src_size, unsafe_symbs);
+
+	if(!entry)
+		return decoded_size;
+
+	entry->hash = hash;
+	entry->size = size;
+	entry->src_size = src_size;
+	entry->unsafe_symbs_size = symbs_size;
+	entry->decoded_size = decoded_size;
+	memcpy(entry->data + src_size + symbs_size, dest, decoded_size);
+
+	pthread_mutex_lock(&shard->lock);
+
+	// another worker may have inserted it meanwhile
+	struct cache_entry **slot = find_entry(bucket, hash, entry->data,
+		src_size, unsafe_symbs, symbs_size);
+
+	if(*slot)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		free(entry);
+		return decoded_size;
+	}
+
+	while(shard->used + size > cache->shard_budget)
+	{
+		evict_oldest(cache, shard);
+
+		// the bucket chain may have changed
+		slot = find_entry(bucket, hash, entry->data, src_size,
+			unsafe_symbs, symbs_size);
+	}
+
+	entry->next = NULL;
+	*slot = entry;
+	link_newest(shard, entry);
+	shard->used += size;
+
+	pthread_mutex_unlock(&shard->lock);
+	return decoded_size;
+}
+
+
+static size_t getc_utf8(const char *buffer, size_t size, unsigned long *cp)
+{
+	const unsigned char *bytes = (const unsigned char *)buffer;
+
+	size_t len = bytes[0] < 0x80 ? 1 : bytes[0] < 0xC0 ? 0
+		: bytes[0] < 0xE0 ? 2 : bytes[0] < 0xF0 ? 3 : bytes[0] < 0xF8 ? 4 : 0;
+	if(!len || len > size)
+		return 0;
+
+	*cp = len == 1 ? bytes[0] : bytes[0] & (0x7Fu >> len);
+	for(size_t i = 1; i < len; ++i)
+	{
+		if((bytes[i] & 0xC0) != 0x80)
+			return 0;
+
+		*cp = *cp << 6 | (bytes[i] & 0x3F);
+	}
+
+	return len;
+}
+
+static _Bool is_space_cp(unsigned long cp)
+{
+	// including &nbsp;, &ensp;, &emsp; and &thinsp;
+	return cp == ' ' || (cp >= '\t' && cp <= '\r') || cp == 0xA0ul
+		|| (cp >= 0x2002ul && cp <= 0x200Aul);
+}
+
+static _Bool is_zero_width_cp(unsigned long cp)
+{
+	// including &zwnj; and &zwj;
+	return (cp >= 0x200Bul && cp <= 0x200Dul) || cp == 0x2060ul
+		|| cp == 0xFEFFul;
+}
+
+/*	Folds the upper case letters of the entity table: Latin-1, Greek,
+	&OElig;, &Scaron; and &Yuml;
+*/
+static unsigned long fold_cp(unsigned long cp, unsigned normalization)
+{
+	if(normalization & NORMALIZE_FOLD_ASCII)
+	{
+		if(cp >= 'A' && cp <= 'Z')
+			return cp + ('a' - 'A');
+	}
+
+	if(normalization & NORMALIZE_FOLD_LATIN1_GREEK)
+	{
+		if((cp >= 0xC0ul && cp <= 0xDEul && cp != 0xD7ul)
+			|| (cp >= 0x391ul && cp <= 0x3A9ul && cp != 0x3A2ul))
+			return cp + 0x20;
+
+		if(cp == 0x152ul || cp == 0x160ul)
+			return cp + 1;
+
+		if(cp == 0x178ul)
+			return 0xFFul;
+	}
+
+	return cp;
+}
+
+struct normalizer {
+	char *to;
+	char *content_end; // output without trailing whitespace
+	unsigned normalization;
+	_Bool started, pending_space;
+};
+
+static void put_normalized(struct normalizer *n, const char *symb,
+	size_t len, unsigned long cp)
+{
+	unsigned normalization = n->normalization;
+
+	if((normalization & NORMALIZE_STRIP_ZERO_WIDTH) && is_zero_width_cp(cp))
+		return;
+
+	if((normalization & (NORMALIZE_COLLAPSE_WHITESPACE
+		| NORMALIZE_TRIM_WHITESPACE)) && is_space_cp(cp))
+	{
+		if(normalization & NORMALIZE_COLLAPSE_WHITESPACE)
+			n->pending_space = 1;
+		else if(n->started || !(normalization & NORMALIZE_TRIM_WHITESPACE))
+		{
+			memmove(n->to, symb, len);
+			n->to += len;
+		}
+
+		return;
+	}
+
+	if(n->pending_space)
+	{
+		if(n->started || !(normalization & NORMALIZE_TRIM_WHITESPACE))
+			*n->to++ = ' ';
+
+		n->pending_space = 0;
+	}
+
+	unsigned long folded = fold_cp(cp, normalization);
+	if(folded != cp)
+		n->to += putc_utf8(folded, n->to);
+	else
+	{
+		memmove(n->to, symb, len);
+		n->to += len;
+	}
+
+	n->started = 1;
+	n->content_end = n->to;
+}
+
+size_t decode_html_entities_utf8_normalized_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs, unsigned normalization)
+{
+	if(!src) src = dest;
+
+	struct normalizer n = { dest, dest, normalization, 0, 0 };
+	const char *from = src;
+	const char *const stop = src + src_size;
+
+	while(from < stop)
+	{
+		unsigned long cp = ULONG_MAX;
+
+		if(*from == '&')
+		{
+			char entity[UTF8_MAX];
+			size_t entity_len;
+			size_t consumed = parse_entity_lookahead_n(from, stop, entity,
+				&entity_len, unsafe_symbs);
+
+			// unsafe entities are kept and normalized like text
+			if(consumed)
+			{
+				getc_utf8(entity, entity_len, &cp);
+				put_normalized(&n, entity, entity_len, cp);
+
+				from += consumed;
+				continue;
+			}
+		}
+
+		size_t len = getc_utf8(from, (size_t)(stop - from), &cp);
+		if(!len)
+		{
+			// invalid UTF-8 is passed through as is
+			cp = ULONG_MAX;
+			len = 1;
+		}
+
+		put_normalized(&n, from, len, cp);
+		from += len;
+	}
+
+	if(n.pending_space && !(normalization & NORMALIZE_TRIM_WHITESPACE))
+		*n.to++ = ' ';
+
+	if(normalization & NORMALIZE_TRIM_WHITESPACE)
+		n.to = n.content_end;
+
+	return (size_t)(n.to - dest);
+}
+
+
+/*	Copies as much of [<run>, <end>) as fits before <to_stop> without
+	splitting a UTF-8 sequence, returns the end of the copied part.
+*/
+static const char *copy_bounded_n(char **to, const char *to_stop,
+	const char *run, const char *end)
+{
+	size_t len = (size_t)(end - run);
+
+	if(len > (size_t)(to_stop - *to))
+	{
+		len = (size_t)(to_stop - *to);
+
+		// back off to the lead byte of a split sequence, stray
+		// continuation bytes are copied one by one
+		for(size_t back = 1; back <= 3 && back <= len; ++back)
+		{
+			unsigned char byte = (unsigned char)run[len - back];
+			if((byte & 0xC0) == 0x80)
+				continue;
+
+			size_t seq_len = byte < 0xC0 ? 1 : byte < 0xE0 ? 2
+				: byte < 0xF0 ? 3 : byte < 0xF8 ? 4 : 1;
+			if(seq_len > back)
+				len -= back;
+
+			break;
+		}
+	}
+
+	memmove(*to, run, len);
+	*to += len;
+
+	return run + len;
+}
+
+size_t decode_html_entities_utf8_wo_unsafe_symbols_bounded_n(char *dest,
+	size_t dest_capacity, const char *src, size_t src_size,
+	const char* unsafe_symbs, size_t *consumed)
+{
+	if(!src) src = dest;
+
+	char *to = dest;
+	const char *const to_stop = dest + dest_capacity;
+
+	const char *run = src;
+	const char *from = src;
+	const char *const stop = src + src_size;
+
+	for(const char *current;
+		(current = strchr_n(from, (size_t)(stop - from), '&'));)
+	{
+		char entity[UTF8_MAX];
+		size_t entity_len;
+		size_t entity_consumed = parse_entity_lookahead_n(current, stop,
+			entity, &entity_len, unsafe_symbs);
+
+		from = current + 1;
+
+		// unknown and unsafe entities are copied like text
+		if(!entity_consumed)
+			continue;
+
+		run = copy_bounded_n(&to, to_stop, run, current);
+
+		// never split an entity, resume with it next time
+		if(run != current || entity_len > (size_t)(to_stop - to))
+		{
+			*consumed = (size_t)(run - src);
+			return (size_t)(to - dest);
+		}
+
+		memcpy(to, entity, entity_len);
+		to += entity_len;
+		run = from = current + entity_consumed;
+	}
+
+	run = copy_bounded_n(&to, to_stop, run, stop);
+
+	*consumed = (size_t)(run - src);
+	return (size_t)(to - dest);
+}
+
+
+static _Bool is_json_special(char c, _Bool non_ascii)
+{
+	unsigned char byte = (unsigned char)c;
+
+	return byte < 0x20 || c == '"' || c == '\\' || c == '&'
+		|| (non_ascii && byte >= 0x80);
+}
+
+/*	Word-at-a-time search for the first character which has to be escaped
+	or may start an entity, returns <stop> if there is none.
+*/
+static const char *find_json_special_n(const char *src, const char *stop,
+	_Bool non_ascii)
+{
+	while((size_t)(stop - src) >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, src, sizeof word);
+
+		// any byte below 0x20, `"', `\' or `&'
+		uint64_t special = ((word - BYTES_OF(0x20)) & ~word & BYTES_OF(0x80))
+			| zero_bytes(word ^ BYTES_OF('"'))
+			| zero_bytes(word ^ BYTES_OF('\\'))
+			| zero_bytes(word ^ BYTES_OF('&'));
+
+		if(non_ascii)
+			special |= word & BYTES_OF(0x80);
+
+		if(special)
+			break;
+
+		src += sizeof word;
+	}
+
+	for(; src < stop; ++src)
+	{
+		if(is_json_special(*src, non_ascii))
+			return src;
+	}
+
+	return stop;
+}
+
+static size_t put_json_u(unsigned long u, char *buffer)
+{
+	static const char HEX_DIGITS[] = "0123456789abcdef";
+
+	buffer[0] = '\\';
+	buffer[1] = 'u';
+	buffer[2] = HEX_DIGITS[(u >> 12) & 0xF];
+	buffer[3] = HEX_DIGITS[(u >> 8) & 0xF];
+	buffer[4] = HEX_DIGITS[(u >> 4) & 0xF];
+	buffer[5] = HEX_DIGITS[u & 0xF];
+
+	return 6;
+}
+
+/*	Writes the JSON string representation of the symbol at <src> to <to>
+	and returns the number of characters consumed.
+*/
+static size_t put_json(const char *src, const char *stop, char **to,
+	_Bool non_ascii)
+{
+	unsigned long cp;
+	size_t len = getc_utf8(src, (size_t)(stop - src), &cp);
+	char escape = 0;
+
+	if(!len)
+	{
+		// invalid UTF-8 has no `\u' representation
+		if(non_ascii)
+			*to += put_json_u(0xFFFDul, *to);
+		else
+			*(*to)++ = *src;
+
+		return 1;
+	}
+
+	switch(cp)
+	{
+		case '"': escape = '"'; break;
+		case '\\': escape = '\\'; break;
+		case '\b': escape = 'b'; break;
+		case '\f': escape = 'f'; break;
+		case '\n': escape = 'n'; break;
+		case '\r': escape = 'r'; break;
+		case '\t': escape = 't'; break;
+		default: break;
+	}
+
+	if(escape)
+	{
+		*(*to)++ = '\\';
+		*(*to)++ = escape;
+	}
+	else if(cp < 0x20ul || (non_ascii && cp >= 0x80ul && cp <= 0xFFFFul))
+		*to += put_json_u(cp, *to);
+	else if(non_ascii && cp > 0xFFFFul)
+	{
+		// surrogate pair
+		*to += put_json_u(0xD800ul + ((cp - 0x10000ul) >> 10), *to);
+		*to += put_json_u(0xDC00ul + ((cp - 0x10000ul) & 0x3FFul), *to);
+	}
+	else
+	{
+		memcpy(*to, src, len);
+		*to += len;
+	}
+
+	return len;
+}
+
+size_t decode_html_entities_utf8_json_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs, unsigned json_escape)
+{
+	char *to = dest;
+	const char *from = src;
+	const char *const stop = src + src_size;
+	const _Bool non_ascii = json_escape & JSON_ESCAPE_NON_ASCII;
+
+	while(from < stop)
+	{
+		const char *current = find_json_special_n(from, stop, non_ascii);
+
+		memcpy(to, from, (size_t)(current - from));
+		to += current - from;
+		from = current;
+
+		if(from == stop)
+			break;
+
+		if(*from == '&')
+		{
+			char entity[UTF8_MAX];
+			size_t entity_len;
+			size_t consumed = parse_entity_lookahead_n(from, stop, entity,
+				&entity_len, unsafe_symbs);
+
+			if(consumed)
+			{
+				for(const char *symb = entity; symb < entity + entity_len;)
+					symb += put_json(symb, entity + entity_len, &to, non_ascii);
+
+				from += consumed;
+				continue;
+			}
+
+			*to++ = *from++;
+			continue;
+		}
+
+		from += put_json(from, stop, &to, non_ascii);
+	}
+
+	return (size_t)(to - dest);
+}
@@ -10,6 +10,8 @@
 
 #include <stddef.h>
 
+struct iovec;
+
 extern size_t decode_html_entities_utf8(char *dest, const char *src);
 /*	Takes input from <src> and decodes into <dest>, which should be a buffer
 	large enough to hold <strlen(src) + 1> characters.
@@ -35,5 +37,143 @@ extern size_t decode_html_entities_utf8_wo_unsafe_symbols_n(char *dest, const ch
 	<src> may be not null terminated!
 */
 
+extern size_t decode_html_entities_utf8_markup_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs);
+/*	Decodes a whole HTML document of <src_size> characters in a single pass.
+
+	Tags, comments, doctypes, CDATA sections and the raw text of <script>,
+	<style>, <iframe>, <noembed>, <noframes> and <xmp> are copied untouched.
+	Entities are decoded in text, in the content of <textarea> and <title>
+	and in attribute values, where decoding never reaches past the end of
+	the (quoted or unquoted) value.
+
+	Like <decode_html_entities_utf8_wo_unsafe_symbols_n> it decodes in-place
+	if <src> is <NULL> and does not terminate <dest>.
+*/
+
+enum percent_decode_order {
+	PERCENT_DECODE_FIRST,	// `%26amp;' becomes `&amp;' becomes `&'
+	ENTITY_DECODE_FIRST	// `&#37;26' becomes `%26' becomes `&'
+};
+
+extern size_t decode_percent_and_html_entities_utf8_n(char *dest,
+	const char *src, size_t src_size, const char* unsafe_symbs,
+	enum percent_decode_order order);
+/*	Decodes both `%XX' escapes and entities of <src_size> characters in a
+	single pass, as if decoding percent escapes and entities one after
+	another in the given <order>.
+
+	Percent escapes forming a UTF-8 sequence are decoded as a whole, so
+	<unsafe_symbs> applies to them just like to numeric entities.
+
+	Entities are decoded like <decode_html_entities_utf8_wo_unsafe_symbols_n>
+	does, with one limit: an entity which is itself (partially) percent
+	encoded, like `%26amp%3B', is only decoded if it spans no more than 32
+	characters once its percent escapes are decoded.
+
+	Like <decode_html_entities_utf8_wo_unsafe_symbols_n> it decodes in-place
+	if <src> is <NULL> and does not terminate <dest>.
+*/
+
+typedef int (*decode_html_entities_sink)(void *sink_data,
+	const struct iovec *iov, int iov_count);
+/*	Receives filled <iov> entries, e.g. to pass them to <writev>. Returns 0
+	on success, anything else aborts decoding.
+*/
+
+extern int decode_html_entities_utf8_iovec_n(struct iovec *iov, int iov_count,
+	char *buffer, size_t buffer_size, const char *src, size_t src_size,
+	const char* unsafe_symbs, decode_html_entities_sink sink, void *sink_data);
+/*	Decodes <src_size> characters of <src> into up to <iov_count> entries of
+	<iov> without copying the unchanged runs: those entries point into
+	<src>, only decoded entities are written to <buffer>, which must hold
+	at least 4 characters. <iov_count> must be at least 1.
+
+	Whenever <iov> or <buffer> is full, the filled entries are passed to
+	<sink> and both are reused. <sink> may be <NULL> if they are known to
+	be large enough.
+
+	The function returns the number of entries left in <iov>, or -1 if
+	<iov_count> is less than 1, they overflowed without a <sink> or <sink>
+	failed.
+*/
+
+struct decode_cache;
+
+extern struct decode_cache *decode_cache_create(size_t memory_budget);
+/*	Creates a cache of decoded strings using at most about <memory_budget>
+	bytes. Least recently used strings are evicted first.
+
+	Returns <NULL> if memory cannot be allocated.
+*/
+
+extern void decode_cache_destroy(struct decode_cache *cache);
+
+extern void decode_cache_stats(struct decode_cache *cache,
+	unsigned long long *hits, unsigned long long *misses);
+/*	Reports how many lookups were answered from <cache> and how many had
+	to be decoded.
+*/
+
+extern size_t decode_html_entities_utf8_cached_n(struct decode_cache *cache,
+	char *dest, const char *src, size_t src_size, const char* unsafe_symbs);
+/*	Same as <decode_html_entities_utf8_wo_unsafe_symbols_n>, but looks up
+	<src> and <unsafe_symbs> in <cache> first. Input without any `&' is
+	copied right away and neither cached nor counted.
+
+	The cache is sharded with a lock per shard, so it may be shared by
+	concurrent threads.
+*/
+
+enum decode_normalization {
+	NORMALIZE_COLLAPSE_WHITESPACE = 1 << 0,
+	NORMALIZE_TRIM_WHITESPACE = 1 << 1,
+	NORMALIZE_FOLD_ASCII = 1 << 2,
+	NORMALIZE_FOLD_LATIN1_GREEK = 1 << 3,
+	NORMALIZE_STRIP_ZERO_WIDTH = 1 << 4
+};
+
+extern size_t decode_html_entities_utf8_normalized_n(char *dest,
+	const char *src, size_t src_size, const char* unsafe_symbs,
+	unsigned normalization);
+/*	Decodes like <decode_html_entities_utf8_wo_unsafe_symbols_n> and
+	normalizes text and decoded entities alike in the same pass.
+	<normalization> combines <enum decode_normalization> flags:
+
+	Whitespace, including &nbsp;, &ensp;, &emsp; and &thinsp;, is collapsed
+	into a single space and/or trimmed. Upper case ASCII and upper case
+	Latin-1 and Greek letters of the entity table are folded to lower case.
+	Zero width characters like &zwj; and &zwnj; are stripped.
+*/
+
+extern size_t decode_html_entities_utf8_wo_unsafe_symbols_bounded_n(char *dest,
+	size_t dest_capacity, const char *src, size_t src_size,
+	const char* unsafe_symbs, size_t *consumed);
+/*	Same as <decode_html_entities_utf8_wo_unsafe_symbols_n>, but writes at
+	most <dest_capacity> characters to <dest>. Decoding stops before an
+	entity or UTF-8 sequence which does not fit, so neither is ever split.
+
+	The function returns the size of the decoded string and stores the
+	number of characters taken from <src> in <*consumed>, decoding may be
+	resumed from there. A <dest_capacity> of at least 4 always makes
+	progress.
+*/
+
+enum json_escape {
+	JSON_ESCAPE_NON_ASCII = 1 << 0
+};
+
+extern size_t decode_html_entities_utf8_json_n(char *dest, const char *src,
+	size_t src_size, const char* unsafe_symbs, unsigned json_escape);
+/*	Decodes like <decode_html_entities_utf8_wo_unsafe_symbols_n> and writes
+	the result escaped for the inside of a JSON string: quotes, backslashes
+	and control characters are escaped in text and decoded entities alike.
+	With <JSON_ESCAPE_NON_ASCII> in <json_escape> non-ASCII characters are
+	written as `\uXXXX' too.
+
+	<dest> has to hold <6 * src_size> characters and must not overlap <src>.
+	It is not terminated.
+*/
+
 #endif // DECODE_HTML_ENTITIES_UTF8_
 
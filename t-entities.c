@@ -9,12 +9,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #undef NDEBUG
 #include <assert.h>
 #include <locale.h>
 #include <limits.h>
 
+struct gather {
+	char buffer[256];
+	size_t len;
+	int calls;
+};
+
+static int gather_sink(void *sink_data, const struct iovec *iov, int iov_count)
+{
+	struct gather *gather = sink_data;
+
+	for(int i = 0; i < iov_count; ++i)
+	{
+		memcpy(gather->buffer + gather->len, iov[i].iov_base, iov[i].iov_len);
+		gather->len += iov[i].iov_len;
+	}
+
+	++gather->calls;
+	return 0;
+}
+
 int main(void)
 {
 	setlocale(LC_ALL, "");
@@ -104,6 +125,320 @@ int main(void)
 	}
 
 
+	{
+		static const char SAMPLE[] = "<p title=\"a&amp;b\" data-x='&lt;' id=&gt;>Gärtner &lt; &amp;</p>"
+			"<!-- &amp; --><script>if(a &amp;&amp; b) x = '</p>';</script>"
+			"<STYLE type=\"&quot;\">a::after { content: \"&amp;\" }</style >"
+			"<title>&lt;&gt;</title><a href=\"?a=1&b=2&amp;c=3\">x &#60; y</a>";
+		static const char INPUT[] = "<p title=\"a&amp;amp;b\" data-x='&amp;lt;' id=&amp;gt;>G&auml;rtner &amp;lt; &amp;amp;</p>"
+			"<!-- &amp; --><script>if(a &amp;&amp; b) x = '</p>';</script>"
+			"<STYLE type=\"&amp;quot;\">a::after { content: \"&amp;\" }</style >"
+			"<title>&amp;lt;&amp;gt;</title><a href=\"?a=1&b=2&amp;amp;c=3\">x &#60; y</a>";
+		char buffer[sizeof INPUT];
+
+		size_t len = decode_html_entities_utf8_markup_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0");
+		assert(len == sizeof SAMPLE - 1);
+		assert(strncmp(buffer, SAMPLE, len) == 0);
+	}
+
+	{
+		char INPUT[] = "<a title=\"&amp;&#62;\">&lt;</a><!-->&amp;< b&amp;<p>&#60;script&#62;</p>";
+		static const char SAMPLE[] = "<a title=\"&&#62;\"><</a><!-->&< b&<p>&#60;script&#62;</p>";
+
+		size_t len = decode_html_entities_utf8_markup_n(INPUT, NULL, sizeof INPUT - 1, "<\0>\0\0");
+		assert(len == sizeof SAMPLE - 1);
+		assert(strncmp(INPUT, SAMPLE, len) == 0);
+	}
+
+	{
+		// unsafe entities are kept intact when decoding in-place
+		char INPUT[] = "x&#60;y&#x41;";
+		char INPUT_N[] = "x&#60;y&#x41;";
+
+		assert(decode_html_entities_utf8_wo_unsafe_symbols(INPUT, NULL, "<\0\0") == sizeof "x&#60;yA" - 1);
+		assert(strcmp(INPUT, "x&#60;yA") == 0);
+
+		size_t len = decode_html_entities_utf8_wo_unsafe_symbols_n(INPUT_N, NULL, sizeof INPUT_N - 1, "<\0\0");
+		assert(len == sizeof "x&#60;yA" - 1);
+		assert(strncmp(INPUT_N, "x&#60;yA", len) == 0);
+	}
+
+
+	{
+		static const char INPUT[] = "/s?q=a%26amp%3Bb&amp;c=%D0%9F%3C&#x2F;%2541&#37;41&lt%3B%26%2360;";
+		char buffer[sizeof INPUT];
+
+		static const char PERCENT_FIRST[] = "/s?q=a&b&c=П%3C/%41%41<&#60;";
+		size_t len = decode_percent_and_html_entities_utf8_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", PERCENT_DECODE_FIRST);
+		assert(len == sizeof PERCENT_FIRST - 1);
+		assert(strncmp(buffer, PERCENT_FIRST, len) == 0);
+
+		static const char ENTITY_FIRST[] = "/s?q=a&amp;b&c=П%3C/%41A&lt;&#60;";
+		len = decode_percent_and_html_entities_utf8_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", ENTITY_DECODE_FIRST);
+		assert(len == sizeof ENTITY_FIRST - 1);
+		assert(strncmp(buffer, ENTITY_FIRST, len) == 0);
+	}
+
+	{
+		static const char PERCENT_INPUT[] = "&a%6dp;&#%36%30;&%&amp;";
+		static const char ENTITY_INPUT[] = "%4&#x31;%&#x34;1%&amp;41";
+		char buffer[sizeof ENTITY_INPUT];
+
+		size_t len = decode_percent_and_html_entities_utf8_n(buffer, PERCENT_INPUT, sizeof PERCENT_INPUT - 1, "\0", PERCENT_DECODE_FIRST);
+		assert(len == sizeof "&<&%&" - 1);
+		assert(strncmp(buffer, "&<&%&", len) == 0);
+
+		len = decode_percent_and_html_entities_utf8_n(buffer, ENTITY_INPUT, sizeof ENTITY_INPUT - 1, "\0", ENTITY_DECODE_FIRST);
+		assert(len == sizeof "AA%&41" - 1);
+		assert(strncmp(buffer, "AA%&41", len) == 0);
+	}
+
+	{
+		char INPUT[] = "%%2%zz&&amp%amp;%41%C3%A4%C3";
+
+		size_t len = decode_percent_and_html_entities_utf8_n(INPUT, NULL, sizeof INPUT - 1, "\0", PERCENT_DECODE_FIRST);
+		assert(len == sizeof "%%2%zz&&amp%amp;Aä\xC3" - 1);
+		assert(strncmp(INPUT, "%%2%zz&&amp%amp;Aä\xC3", len) == 0);
+	}
+
+
+	{
+		static const char SAMPLE[] = "Christoph Gärtner &#60; &unknown; &€ÄÖÜ, <3 & &#x3C;3";
+		static const char INPUT[] = "Christoph G&auml;rtner &#60; &unknown; &&euro;&Auml;&Ouml;&Uuml;, &lt;3 &amp; &#x3C;3";
+		struct iovec iov[3];
+		char buffer[6];
+		struct gather gather = { { 0 }, 0, 0 };
+
+		int used = decode_html_entities_utf8_iovec_n(iov, 3, buffer, sizeof buffer, INPUT, sizeof INPUT - 1, "<\0\0", gather_sink, &gather);
+		assert(used > 0);
+		assert(gather.calls > 1);
+		assert((char *)iov[used - 1].iov_base == strstr(INPUT, " &#x3C;3"));
+		gather_sink(&gather, iov, used);
+
+		assert(gather.len == sizeof SAMPLE - 1);
+		assert(strncmp(gather.buffer, SAMPLE, gather.len) == 0);
+
+		// unchanged runs are referenced, not copied
+		assert(decode_html_entities_utf8_iovec_n(iov, 1, buffer, sizeof buffer, INPUT, 10, "\0", NULL, NULL) == 1);
+		assert(iov[0].iov_base == INPUT && iov[0].iov_len == 10);
+		assert(decode_html_entities_utf8_iovec_n(iov, 1, buffer, sizeof buffer, INPUT, sizeof INPUT - 1, "\0", NULL, NULL) == -1);
+		assert(decode_html_entities_utf8_iovec_n(iov, 0, buffer, sizeof buffer, INPUT, sizeof INPUT - 1, "\0", gather_sink, &gather) == -1);
+	}
+
+
+	{
+		static const char INPUT[] = "Christoph G&auml;rtner &#60;3";
+		struct decode_cache *cache = decode_cache_create(4096);
+		unsigned long long hits, misses;
+		char buffer[sizeof INPUT];
+		assert(cache);
+
+		for(int i = 0; i < 3; ++i)
+		{
+			size_t len = decode_html_entities_utf8_cached_n(cache, buffer, INPUT, sizeof INPUT - 1, "<\0\0");
+			assert(len == sizeof "Christoph Gärtner &#60;3" - 1);
+			assert(strncmp(buffer, "Christoph Gärtner &#60;3", len) == 0);
+		}
+
+		size_t len = decode_html_entities_utf8_cached_n(cache, buffer, INPUT, sizeof INPUT - 1, "\0");
+		assert(len == sizeof "Christoph Gärtner <3" - 1);
+		assert(strncmp(buffer, "Christoph Gärtner <3", len) == 0);
+
+		// no entities, bypassed
+		assert(decode_html_entities_utf8_cached_n(cache, buffer, "plain", 5, "\0") == 5);
+
+		decode_cache_stats(cache, &hits, &misses);
+		assert(hits == 2 && misses == 2);
+
+		// evicts but keeps working on a tiny budget
+		char key[32];
+		for(int i = 0; i < 1000; ++i)
+		{
+			int key_len = sprintf(key, "&lt;%d&gt;", i % 100);
+			len = decode_html_entities_utf8_cached_n(cache, buffer, key, (size_t)key_len, "\0");
+			assert(len == (size_t)key_len - 6);
+			assert(buffer[0] == '<' && buffer[len - 1] == '>');
+		}
+
+		char in_place[] = "&lt;&gt;";
+		assert(decode_html_entities_utf8_cached_n(cache, in_place, NULL, sizeof in_place - 1, "\0") == 2);
+		assert(strncmp(in_place, "<>", 2) == 0);
+
+		// what an in-place call caches is served to later callers as is
+		char unsafe_in_place[] = "x&#60;y";
+		len = decode_html_entities_utf8_cached_n(cache, unsafe_in_place, NULL, sizeof unsafe_in_place - 1, "<\0\0");
+		assert(len == sizeof "x&#60;y" - 1);
+		assert(strncmp(unsafe_in_place, "x&#60;y", len) == 0);
+
+		decode_cache_stats(cache, &hits, &misses);
+		unsigned long long hits_before = hits;
+
+		len = decode_html_entities_utf8_cached_n(cache, buffer, "x&#60;y", sizeof "x&#60;y" - 1, "<\0\0");
+		assert(len == sizeof "x&#60;y" - 1);
+		assert(strncmp(buffer, "x&#60;y", len) == 0);
+
+		decode_cache_stats(cache, &hits, &misses);
+		assert(hits == hits_before + 1);
+
+		decode_cache_destroy(cache);
+	}
+
+
+	{
+		static const char INPUT[] = " &nbsp;Christoph&#32;&#32;G&Auml;RTNER\t&thinsp;\xC3\x9C&Omega;&Yuml;&#60;&zwj;a&zwnj;b \n";
+		char buffer[sizeof INPUT];
+		size_t len;
+
+		len = decode_html_entities_utf8_normalized_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0",
+			NORMALIZE_COLLAPSE_WHITESPACE | NORMALIZE_TRIM_WHITESPACE | NORMALIZE_FOLD_ASCII
+			| NORMALIZE_FOLD_LATIN1_GREEK | NORMALIZE_STRIP_ZERO_WIDTH);
+		assert(len == sizeof "christoph gärtner üωÿ&#60;ab" - 1);
+		assert(strncmp(buffer, "christoph gärtner üωÿ&#60;ab", len) == 0);
+
+		len = decode_html_entities_utf8_normalized_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0",
+			NORMALIZE_COLLAPSE_WHITESPACE | NORMALIZE_FOLD_ASCII);
+		assert(len == sizeof " christoph gÄrtner ÜΩŸ&#60;\xE2\x80\x8D" "a\xE2\x80\x8C" "b " - 1);
+		assert(strncmp(buffer, " christoph gÄrtner ÜΩŸ&#60;\xE2\x80\x8D" "a\xE2\x80\x8C" "b ", len) == 0);
+
+		len = decode_html_entities_utf8_normalized_n(buffer, INPUT, sizeof INPUT - 1, "\0",
+			NORMALIZE_TRIM_WHITESPACE);
+		assert(len == sizeof "Christoph  GÄRTNER\t\xE2\x80\x89ÜΩŸ<\xE2\x80\x8D" "a\xE2\x80\x8C" "b" - 1);
+		assert(strncmp(buffer, "Christoph  GÄRTNER\t\xE2\x80\x89ÜΩŸ<\xE2\x80\x8D" "a\xE2\x80\x8C" "b", len) == 0);
+
+		char in_place[] = "  &nbsp; ";
+		assert(decode_html_entities_utf8_normalized_n(in_place, NULL, sizeof in_place - 1, "\0",
+			NORMALIZE_COLLAPSE_WHITESPACE | NORMALIZE_TRIM_WHITESPACE) == 0);
+	}
+
+
+	{
+		// the search for `;' must not run off beyond an entity
+		static const char SAMPLE[] = "&amp &&thetasy &#x41 & <A\x05&#;&#x;";
+		static const char INPUT[] = "&amp &&amp;thetasy &#x41 &amp; &lt;&#x000000000000000041;&#5;&#;&#x;";
+		char buffer[sizeof INPUT];
+
+		assert(decode_html_entities_utf8(buffer, INPUT) == sizeof SAMPLE - 1);
+		assert(strcmp(buffer, SAMPLE) == 0);
+
+		assert(decode_html_entities_utf8_wo_unsafe_symbols(buffer, INPUT, "\0") == sizeof SAMPLE - 1);
+		assert(strcmp(buffer, SAMPLE) == 0);
+
+		size_t len = decode_html_entities_utf8_wo_unsafe_symbols_n(buffer, INPUT, sizeof INPUT - 1, "\0");
+		assert(len == sizeof SAMPLE - 1);
+		assert(strncmp(buffer, SAMPLE, len) == 0);
+
+		// numeric entity cut off by <src_size>
+		assert(decode_html_entities_utf8_wo_unsafe_symbols_n(buffer, "&#65;", 4, "\0") == 4);
+		assert(strncmp(buffer, "&#65", 4) == 0);
+	}
+
+
+	{
+		static const char *const INPUTS[] = {
+			"Christoph G&auml;rtner &#60;&#1055;&#62;авел&#62; &amp&#x1F600;&lt;",
+			// invalid UTF-8 still makes progress
+			"\x80\x80\x80\x80\x80\x80\x80\x80",
+			"€\x80\x80&auml;\xE2\x82&#x1F600;\xF0\x9F\x98\xC3"
+		};
+		char expected[128];
+		char buffer[128];
+
+		for(size_t i = 0; i < sizeof INPUTS / sizeof *INPUTS; ++i)
+		{
+			const char *INPUT = INPUTS[i];
+			size_t input_len = strlen(INPUT);
+			size_t expected_len = decode_html_entities_utf8_wo_unsafe_symbols_n(expected, INPUT, input_len, "<\0\0");
+
+			for(size_t capacity = 4; capacity < 8; ++capacity)
+			{
+				size_t len = 0;
+				size_t offset = 0;
+
+				while(offset < input_len)
+				{
+					char slot[8];
+					size_t consumed;
+					size_t written = decode_html_entities_utf8_wo_unsafe_symbols_bounded_n(slot, capacity,
+						INPUT + offset, input_len - offset, "<\0\0", &consumed);
+
+					assert(written <= capacity);
+					assert(consumed > 0);
+
+					// each slot holds complete UTF-8 sequences
+					assert(i != 0 || ((unsigned char)slot[0] & 0xC0) != 0x80);
+
+					memcpy(buffer + len, slot, written);
+					len += written;
+					offset += consumed;
+				}
+
+				assert(len == expected_len);
+				assert(strncmp(buffer, expected, len) == 0);
+			}
+		}
+
+		size_t consumed;
+		assert(decode_html_entities_utf8_wo_unsafe_symbols_bounded_n(buffer, 3, "&#x1F600;", 9, "\0", &consumed) == 0);
+		assert(consumed == 0);
+	}
+
+
+	{
+		static const char INPUT[] = "\"G&auml;rtner\" &quot;a\\b&quot;\n&#9;&#1;&#x1F600;&#60;\x7F\x01 &amp plain text";
+		char buffer[6 * sizeof INPUT];
+		size_t len;
+
+		static const char SAMPLE[] = "\\\"Gärtner\\\" \\\"a\\\\b\\\"\\n\\t\\u0001\xF0\x9F\x98\x80&#60;\x7F\\u0001 &amp plain text";
+		len = decode_html_entities_utf8_json_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", 0);
+		assert(len == sizeof SAMPLE - 1);
+		assert(strncmp(buffer, SAMPLE, len) == 0);
+
+		static const char ASCII_SAMPLE[] = "\\\"G\\u00e4rtner\\\" \\\"a\\\\b\\\"\\n\\t\\u0001\\ud83d\\ude00&#60;\x7F\\u0001 &amp plain text";
+		len = decode_html_entities_utf8_json_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", JSON_ESCAPE_NON_ASCII);
+		assert(len == sizeof ASCII_SAMPLE - 1);
+		assert(strncmp(buffer, ASCII_SAMPLE, len) == 0);
+
+		assert(decode_html_entities_utf8_json_n(buffer, "\xFF", 1, "\0", JSON_ESCAPE_NON_ASCII) == 6);
+		assert(strncmp(buffer, "\\ufffd", 6) == 0);
+	}
+
+
+	{
+		// numeric entities of any length decode alike in every mode
+		static const char INPUT[] = "x&#x0000000000000000000000000000000041;&#000000000000000000000000000000000060;";
+		static const char SAMPLE[] = "xA&#000000000000000000000000000000000060;";
+		char buffer[6 * sizeof INPUT];
+		size_t len;
+
+		len = decode_html_entities_utf8_wo_unsafe_symbols_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0");
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		len = decode_percent_and_html_entities_utf8_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", PERCENT_DECODE_FIRST);
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		len = decode_percent_and_html_entities_utf8_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", ENTITY_DECODE_FIRST);
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		len = decode_html_entities_utf8_normalized_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", 0);
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		len = decode_html_entities_utf8_json_n(buffer, INPUT, sizeof INPUT - 1, "<\0\0", 0);
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		size_t consumed;
+		len = decode_html_entities_utf8_wo_unsafe_symbols_bounded_n(buffer, sizeof buffer, INPUT, sizeof INPUT - 1, "<\0\0", &consumed);
+		assert(consumed == sizeof INPUT - 1);
+		assert(len == sizeof SAMPLE - 1 && strncmp(buffer, SAMPLE, len) == 0);
+
+		struct iovec iov[4];
+		struct gather gather = { { 0 }, 0, 0 };
+		int used = decode_html_entities_utf8_iovec_n(iov, 4, buffer, 4, INPUT, sizeof INPUT - 1, "<\0\0", NULL, NULL);
+		assert(used > 0);
+		gather_sink(&gather, iov, used);
+		assert(gather.len == sizeof SAMPLE - 1 && strncmp(gather.buffer, SAMPLE, gather.len) == 0);
+	}
+
+
 	fprintf(stdout, "All tests passed :-)\n");
 	return EXIT_SUCCESS;
 }